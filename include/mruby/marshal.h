@@ -6,7 +6,9 @@ extern "C" {
 #endif
 
 mrb_value mrb_marshal_dump(mrb_state* M, mrb_value v, mrb_value out);
+mrb_value mrb_marshal_dump_into(mrb_state* M, mrb_value v, mrb_value buf);
 mrb_value mrb_marshal_load(mrb_state* M, mrb_value str);
+mrb_value mrb_marshal_deep_copy(mrb_state* M, mrb_value v);
 
 #if defined(__cplusplus)
 }  /* extern "C" { */
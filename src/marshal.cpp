@@ -1,8 +1,11 @@
 #include <mruby.h>
 #include <mruby/array.h>
 #include <mruby/class.h>
+#include <mruby/data.h>
+#include <mruby/error.h>
 #include <mruby/hash.h>
 #include <mruby/khash.h>
+#include <mruby/object.h>
 #include <mruby/string.h>
 #include <mruby/value.h>
 #include <mruby/variable.h>
@@ -14,9 +17,26 @@ extern "C" {
 }
 #endif
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <vector>
+
+// Marshal.dump_fd needs write(2) and threads
+#if !defined(MRUBY_MARSHAL_NO_FD_OUT) && (defined(__unix__) || defined(__APPLE__))
+#define MRUBY_MARSHAL_FD_OUT
+#include <errno.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
 #ifndef MRUBY_VERSION
 #define mrb_module_get mrb_class_get
 #define mrb_args_int int
@@ -55,6 +75,36 @@ namespace {
 
 enum { MAJOR_VERSION = 4, MINOR_VERSION = 8, };
 
+// CRuby writes integers outside of 32bit as bignum
+int64_t const FIXNUM_MIN = -0x80000000LL, FIXNUM_MAX = 0x7fffffffLL;
+
+// number of bytes without leading zero bytes
+inline int byte_length(uint64_t const x) {
+#if defined(__GNUC__)
+  return x == 0? 0 : (64 - __builtin_clzll(x) + 7) / 8;
+#else
+  int ret = 0;
+  for(uint64_t v = x; v != 0; v >>= 8) { ++ret; }
+  return ret;
+#endif
+}
+
+// converts between host order and the little endian order of marshal data
+inline uint64_t little_endian(uint64_t const x) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return __builtin_bswap64(x);
+#else
+  return x;
+#endif
+}
+
+// reads `len` (<= 8) little endian bytes at once
+inline uint64_t load_little_endian(char const* p, size_t const len) {
+  uint64_t x = 0;
+  memcpy(&x, p, len);
+  return little_endian(x);
+}
+
 struct utility {
   utility(mrb_state* M)
       : M(M), regexp_class(mrb_class_get(M, "Regexp"))
@@ -103,12 +153,155 @@ struct utility {
   }
 };
 
-template<class Out>
+// profiling is off: every hook compiles away
+struct null_profile {
+  template<class Out>
+  struct scope { scope(null_profile&, RClass*, Out const&) {} };
+
+  template<class Out>
+  struct ivar_scope { ivar_scope(null_profile&, RClass*, mrb_sym, Out const&) {} };
+};
+
+// attributes output bytes and encode time to the class of each dumped object
+struct class_profile {
+  typedef std::chrono::steady_clock clock;
+
+  struct entry {
+    entry() : count(0), bytes(0), ns(0) {}
+    mrb_int count;
+    size_t bytes;
+    int64_t ns;
+    std::map<mrb_sym, size_t> ivars; // ivar name -> bytes including its value
+  };
+
+  struct frame {
+    size_t start, child_bytes;
+    clock::time_point start_time;
+    clock::duration child_time;
+  };
+
+  explicit class_profile(bool ivars) : ivars(ivars) {}
+
+  bool const ivars;
+  std::map<RClass*, entry> classes;
+  std::vector<frame> stack;
+
+  void enter(size_t pos) {
+    frame const f = { pos, 0, clock::now(), clock::duration::zero() };
+    stack.push_back(f);
+  }
+
+  // only bytes and time not spent in nested objects count for `cls`
+  void leave(RClass* cls, size_t pos) {
+    frame const f = stack.back();
+    stack.pop_back();
+    size_t const bytes = pos - f.start;
+    clock::duration const time = clock::now() - f.start_time;
+
+    entry& e = classes[cls];
+    ++e.count;
+    e.bytes += bytes - f.child_bytes;
+    e.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(time - f.child_time).count();
+
+    if(not stack.empty()) {
+      stack.back().child_bytes += bytes;
+      stack.back().child_time += time;
+    }
+  }
+
+  template<class Out>
+  struct scope {
+    scope(class_profile& p, RClass* cls, Out const& out) : p(p), cls(cls), out(out) { p.enter(out.size()); }
+    ~scope() { p.leave(cls, out.size()); }
+
+    class_profile& p;
+    RClass* const cls;
+    Out const& out;
+  };
+
+  template<class Out>
+  struct ivar_scope {
+    ivar_scope(class_profile& p, RClass* cls, mrb_sym key, Out const& out)
+        : p(p), cls(cls), key(key), out(out), start(out.size()) {}
+    ~ivar_scope() { if(p.ivars) { p.classes[cls].ivars[key] += out.size() - start; } }
+
+    class_profile& p;
+    RClass* const cls;
+    mrb_sym const key;
+    Out const& out;
+    size_t const start;
+  };
+
+  static bool by_bytes(std::pair<RClass*, entry const*> const& lhs, std::pair<RClass*, entry const*> const& rhs) {
+    return lhs.second->bytes > rhs.second->bytes;
+  }
+
+  // Hash of class => {count:, bytes:, ns:[, ivars:]} ordered by bytes
+  mrb_value report(mrb_state* M) const {
+    std::vector<std::pair<RClass*, entry const*> > sorted;
+    for(std::map<RClass*, entry>::const_iterator i = classes.begin(); i != classes.end(); ++i) {
+      sorted.push_back(std::make_pair(i->first, &i->second));
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), &by_bytes);
+
+    mrb_value const ret = mrb_hash_new_capa(M, sorted.size());
+    int const ai = mrb_gc_arena_save(M);
+    for(size_t i = 0; i < sorted.size(); ++i) {
+      entry const& e = *sorted[i].second;
+      mrb_value const stat = mrb_hash_new_capa(M, 4);
+      mrb_hash_set(M, stat, mrb_symbol_value(mrb_intern_lit(M, "count")), mrb_fixnum_value(e.count));
+      mrb_hash_set(M, stat, mrb_symbol_value(mrb_intern_lit(M, "bytes")), mrb_fixnum_value(e.bytes));
+      mrb_hash_set(M, stat, mrb_symbol_value(mrb_intern_lit(M, "ns")), mrb_fixnum_value(e.ns));
+      if(ivars) {
+        mrb_value const iv = mrb_hash_new_capa(M, e.ivars.size());
+        for(std::map<mrb_sym, size_t>::const_iterator j = e.ivars.begin(); j != e.ivars.end(); ++j) {
+          mrb_hash_set(M, iv, mrb_symbol_value(j->first), mrb_fixnum_value(j->second));
+        }
+        mrb_hash_set(M, stat, mrb_symbol_value(mrb_intern_lit(M, "ivars")), iv);
+      }
+      mrb_hash_set(M, ret, mrb_obj_value(sorted[i].first), stat);
+      mrb_gc_arena_restore(M, ai);
+    }
+    return ret;
+  }
+};
+
+void class_profile_free(mrb_state*, void* ptr) {
+  delete static_cast<class_profile*>(ptr);
+}
+
+mrb_data_type const class_profile_type = { "Marshal::Profile", &class_profile_free };
+
+// profile state is owned by a data object so raising while dumping can't leak it
+struct class_profile_ref {
+  class_profile_ref(mrb_state* M, bool ivars)
+      : data(new class_profile(ivars))
+      , holder(mrb_obj_value(mrb_data_object_alloc(M, NULL, data, &class_profile_type))) {}
+
+  class_profile* data;
+  mrb_value holder; // keeps `data` owned by the GC
+
+  template<class Out>
+  struct scope : class_profile::scope<Out> {
+    scope(class_profile_ref& p, RClass* cls, Out const& out)
+        : class_profile::scope<Out>(*p.data, cls, out) {}
+  };
+
+  template<class Out>
+  struct ivar_scope : class_profile::ivar_scope<Out> {
+    ivar_scope(class_profile_ref& p, RClass* cls, mrb_sym key, Out const& out)
+        : class_profile::ivar_scope<Out>(*p.data, cls, key, out) {}
+  };
+};
+
+template<class Out, class Profile = null_profile>
 struct write_context : public utility {
-  write_context(mrb_state *M, Out out) : utility(M), out_(out) {}
+  write_context(mrb_state *M, Out out, Profile profile = Profile())
+      : utility(M), out_(out), profile_(profile) {}
 
   typedef Out out_type;
   out_type out_;
+  Profile profile_;
 
   write_context& symbol(mrb_sym const sym) {
     size_t const len = RARRAY_LEN(symbols);
@@ -137,20 +330,56 @@ struct write_context : public utility {
     else if(0 < v and v < 123) { out_.byte(v + 5); return *this; }
     else if(-124 < v and v < 0) { out_.byte((v - 5) & 0xff); return *this; }
     else {
-      char buf[sizeof(mrb_int) + 1];
-      mrb_int x = v;
-      size_t i = 1;
-      for(; i <= sizeof(mrb_int); ++i) {
-        buf[i] = x & 0xff;
-        x = x < 0 ? ~((~x) >> 8) : (x >> 8);
-        if(x ==  0) { buf[0] =  i; break; }
-        if(x == -1) { buf[0] = -i; break; }
-      }
-      out_.byte_array(buf, i + 1);
+      // drop bytes that only hold the sign
+      uint64_t const x = static_cast<int64_t>(v);
+      int const len = byte_length(v < 0? ~x : x);
+      // length byte of 5 or more would be read as small fixnum
+      if(len > 4) { number_too_big(); }
+      char buf[sizeof(uint64_t) + 1];
+      buf[0] = v < 0? -len : len;
+      uint64_t const le = little_endian(x);
+      memcpy(buf + 1, &le, sizeof(le));
+      out_.byte_array(buf, len + 1);
       return *this;
     }
   }
 
+  void number_too_big() {
+    mrb_raise(M, mrb_class_get(M, "RangeError"), "number too big to dump as fixnum");
+  }
+
+  // magnitude is written in little endian padded to 16bit words
+  write_context& bignum(bool const negative, uint8_t const* mag, size_t const len) {
+    tag('l').tag(negative? '-' : '+').fixnum((len + 1) / 2);
+    out_.byte_array(reinterpret_cast<char const*>(mag), len);
+    if(len % 2) { out_.byte(0); }
+    return *this;
+  }
+
+  write_context& bignum(mrb_int const v) {
+    uint64_t const mag = v < 0? 0 - static_cast<uint64_t>(v) : static_cast<uint64_t>(v);
+    int const len = byte_length(mag);
+    uint64_t const le = little_endian(mag);
+    return bignum(v < 0, reinterpret_cast<uint8_t const*>(&le), len);
+  }
+
+#ifdef MRB_USE_BIGINT
+  write_context& bignum(mrb_value const& v) {
+    bool const negative = mrb_test(mrb_funcall(M, v, "<", 1, mrb_fixnum_value(0)));
+    mrb_value const hex = mrb_funcall(M, mrb_funcall(M, v, "abs", 0), "to_s", 1, mrb_fixnum_value(16));
+    char const* const digits = RSTRING_PTR(hex);
+    size_t const digit_len = RSTRING_LEN(hex), len = (digit_len + 1) / 2;
+
+    std::vector<uint8_t> mag(len);
+    for(size_t i = 0; i < digit_len; ++i) { // last digit is the lowest nibble
+      char const c = digits[digit_len - 1 - i];
+      uint8_t const nibble = c <= '9'? c - '0' : (c | 0x20) - 'a' + 10;
+      mag[i / 2] |= nibble << (4 * (i % 2));
+    }
+    return bignum(negative, mag.data(), len);
+  }
+#endif
+
   write_context& string(char const* str, size_t len) {
     fixnum(len);
     out_.byte_array(str, len);
@@ -221,8 +450,8 @@ struct write_context : public utility {
   }
 };
 
-template<class Out>
-write_context<Out>& write_context<Out>::marshal(mrb_value const& v, mrb_int limit) {
+template<class Out, class Profile>
+write_context<Out, Profile>& write_context<Out, Profile>::marshal(mrb_value const& v, mrb_int limit) {
   if (limit == 0) { mrb_raise(M, mrb_class_get(M, "ArgumentError"), "depth limit"); }
   --limit;
 
@@ -243,13 +472,24 @@ write_context<Out>& write_context<Out>::marshal(mrb_value const& v, mrb_int limi
   switch(mrb_vtype(mrb_type(v))) {
     case MRB_TT_FALSE: return tag('F');
     case MRB_TT_TRUE : return tag('T');
-    case MRB_TT_FIXNUM: return tag('i').fixnum(mrb_fixnum(v));
+    case MRB_TT_FIXNUM: {
+      mrb_int const i = mrb_fixnum(v);
+      if(FIXNUM_MIN <= i and i <= FIXNUM_MAX) { return tag('i').fixnum(i); }
+      mrb_ary_push(M, objects, v); // bignum takes an object index
+      return bignum(i);
+    }
+#ifdef MRB_USE_BIGINT
+    case MRB_TT_BIGINT:
+      mrb_ary_push(M, objects, v);
+      return bignum(v);
+#endif
     case MRB_TT_SYMBOL: return symbol(mrb_symbol(v));
 
     default: break;
   }
 
   mrb_ary_push(M, objects, v);
+  typename Profile::template scope<Out> const profile_scope(profile_, cls, out_);
 
   // check marshal_dump
   if(mrb_obj_respond_to(M, cls, mrb_intern_lit(M, "marshal_dump"))) {
@@ -282,8 +522,9 @@ write_context<Out>& write_context<Out>::marshal(mrb_value const& v, mrb_int limi
   } else if(mrb_type(v) == MRB_TT_OBJECT) {
     klass('o', v, true).fixnum(RARRAY_LEN(iv_keys));
     for(int i = 0; i < RARRAY_LEN(iv_keys); ++i) {
-      symbol(mrb_symbol(RARRAY_PTR(iv_keys)[i]))
-          .marshal(mrb_iv_get(M, v, mrb_symbol(RARRAY_PTR(iv_keys)[i])), limit);
+      mrb_sym const key = mrb_symbol(RARRAY_PTR(iv_keys)[i]);
+      typename Profile::template ivar_scope<Out> const profile_ivar(profile_, cls, key, out_);
+      symbol(key).marshal(mrb_iv_get(M, v, key), limit);
     }
     return *this;
   } else switch(mrb_vtype(mrb_type(v))) {
@@ -358,28 +599,118 @@ write_context<Out>& write_context<Out>::marshal(mrb_value const& v, mrb_int limi
     RObject* const obj = mrb_obj_ptr(v);
     for(int i = 0; i < RARRAY_LEN(iv_keys); ++i) {
       mrb_sym const key = mrb_symbol(RARRAY_PTR(iv_keys)[i]);
+      typename Profile::template ivar_scope<Out> const profile_ivar(profile_, cls, key, out_);
       symbol(key).marshal(mrb_obj_iv_get(M, obj, key), limit);
     }
   }
   return *this;
 }
 
+// writes directly into the String buffer; length is fixed up by finish()
+// the String must not be reachable from ruby code while dumping
 struct string_out {
-  string_out(mrb_state* M, mrb_value const& str) : M(M), out(str) {}
+  enum { INITIAL_CAPA = 64 };
+
+  string_out(mrb_state* M, mrb_value const& str, size_t capa_hint = 0)
+      : M(M), out(str), len(0), capa(0) {
+    mrb_str_modify(M, RSTRING(out));
+    capa = RSTRING_CAPA(out);
+    if(capa < capa_hint) { reserve(capa_hint); }
+  }
 
   mrb_state * const M;
   mrb_value out;
+  size_t len, capa;
 
   void byte(uint8_t const v) {
-    char const buf[] = {static_cast<char>(v)};
-    mrb_str_buf_cat(M, out, buf, 1);
+    if(len == capa) { reserve(len + 1); }
+    RSTRING_PTR(out)[len++] = static_cast<char>(v);
   }
 
-  void byte_array(char const *buf, size_t len) {
-    mrb_str_buf_cat(M, out, buf, len);
+  void byte_array(char const *buf, size_t size) {
+    if(len + size > capa) { reserve(len + size); }
+    memcpy(RSTRING_PTR(out) + len, buf, size);
+    len += size;
+  }
+
+  size_t size() const { return len; }
+
+  void finish() {
+    RSTR_SET_LEN(RSTRING(out), len);
+    RSTRING_PTR(out)[len] = '\0';
   }
+
+ private:
+  void reserve(size_t const required) {
+    size_t new_capa = capa < INITIAL_CAPA? size_t(INITIAL_CAPA) : capa;
+    while(new_capa < required) { new_capa *= 2; }
+    RSTR_SET_LEN(RSTRING(out), len); // keep written bytes on reallocation
+    mrb_str_resize(M, out, new_capa);
+    capa = new_capa;
+  }
+};
+
+mrb_value dump_to_string(mrb_state* M, mrb_value const& obj, mrb_value const& str,
+                         mrb_int limit, size_t capa_hint = 0) {
+  write_context<string_out> ctx(M, string_out(M, str, capa_hint));
+  ctx.version().marshal(obj, limit);
+  ctx.out_.finish();
+  return str;
+}
+
+// exchanges the storage of two unshared Strings (see mrb_str_modify)
+void swap_string_buffer(mrb_value const& lhs, mrb_value const& rhs) {
+  RString* const l = RSTRING(lhs);
+  RString* const r = RSTRING(rhs);
+  uint32_t const flags = l->flags; // embed and length flags follow the storage
+  l->flags = r->flags;
+  r->flags = flags;
+
+  char tmp[sizeof(l->as)];
+  memcpy(tmp, &l->as, sizeof(tmp));
+  memcpy(&l->as, &r->as, sizeof(tmp));
+  memcpy(&r->as, tmp, sizeof(tmp));
+}
+
+struct dump_into_args {
+  mrb_value obj, buf, work;
+  mrb_int limit;
+  size_t capa_hint;
+  bool done;
 };
 
+mrb_value dump_into_body(mrb_state* M, mrb_value data) {
+  dump_into_args* const args = static_cast<dump_into_args*>(mrb_cptr(data));
+  dump_to_string(M, args->obj, args->work, args->limit, args->capa_hint);
+  args->done = true;
+  return mrb_nil_value();
+}
+
+mrb_value dump_into_ensure(mrb_state* M, mrb_value data) {
+  dump_into_args* const args = static_cast<dump_into_args*>(mrb_cptr(data));
+  if(not args->done) { // hand back an empty String when dumping raised
+    RSTR_SET_LEN(RSTRING(args->work), 0);
+    RSTRING_PTR(args->work)[0] = '\0';
+  }
+  if(MRB_FROZEN_P(RSTRING(args->buf))) { return mrb_nil_value(); } // frozen by a callback
+  mrb_str_modify(M, RSTRING(args->buf)); // callbacks may have shared it
+  swap_string_buffer(args->buf, args->work);
+  return mrb_nil_value();
+}
+
+// the storage of `buf` is detached into a private String while dumping so
+// ruby code only sees an empty `buf`, and attached back when done or raised
+mrb_value dump_into_string(mrb_state* M, mrb_value const& obj, mrb_value const& buf,
+                           mrb_int limit, size_t capa_hint = 0) {
+  mrb_str_modify(M, RSTRING(buf));
+  dump_into_args args = { obj, buf, mrb_str_new(M, NULL, 0), limit, capa_hint, false };
+  swap_string_buffer(buf, args.work);
+
+  mrb_ensure(M, &dump_into_body, mrb_cptr_value(M, &args), &dump_into_ensure, mrb_cptr_value(M, &args));
+  if(MRB_FROZEN_P(RSTRING(buf))) { mrb_str_modify(M, RSTRING(buf)); } // raises FrozenError
+  return buf;
+}
+
 struct io_out {
   io_out(mrb_state* M, mrb_value const& out)
       : M(M), out(out), buf(mrb_str_new(M, NULL, 0)) {}
@@ -400,12 +731,142 @@ struct io_out {
   }
 };
 
+#ifdef MRUBY_MARSHAL_FD_OUT
+// double buffered writer: encoder fills `front` while the thread writes `back`
+struct fd_writer {
+  enum { BUFFER_SIZE = 64 * 1024 };
+
+  explicit fd_writer(int fd)
+      : fd(fd), pending(false), done(false), aborted(false), error(0) {
+    front.reserve(BUFFER_SIZE);
+    back.reserve(BUFFER_SIZE);
+    thread = std::thread(&fd_writer::run, this);
+  }
+
+  ~fd_writer() { stop(true); }
+
+  int const fd;
+  std::vector<char> front, back;
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool pending, done, aborted;
+  int error;
+  std::thread thread;
+
+  // hand `front` to the writer thread; returns errno of previous writes
+  int submit() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this] { return not pending; });
+    if(error != 0) { return error; }
+    front.swap(back);
+    pending = true;
+    cond.notify_all();
+    return 0;
+  }
+
+  // flush remaining bytes and join the writer thread
+  int finish() {
+    if(not front.empty()) { submit(); }
+    stop(false);
+    return error;
+  }
+
+  // drop queued bytes and join after the write in progress (if any)
+  void abort() { stop(true); }
+
+ private:
+  void stop(bool const discard = false) {
+    if(not thread.joinable()) { return; }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      done = true;
+      aborted = discard;
+    }
+    cond.notify_all();
+    thread.join();
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true) {
+      cond.wait(lock, [this] { return pending or done; });
+      if(aborted or not pending) { break; }
+
+      lock.unlock();
+      int const err = write_all(back.data(), back.size());
+      lock.lock();
+
+      if(err != 0 and error == 0) { error = err; }
+      back.clear();
+      pending = false;
+      cond.notify_all();
+    }
+  }
+
+  int write_all(char const* ptr, size_t len) const {
+    while(len > 0) {
+      ssize_t const ret = ::write(fd, ptr, len);
+      if(ret < 0) {
+        if(errno == EINTR) { continue; }
+        return errno;
+      }
+      ptr += ret;
+      len -= ret;
+    }
+    return 0;
+  }
+};
+
+void fd_writer_free(mrb_state*, void* ptr) {
+  delete static_cast<fd_writer*>(ptr);
+}
+
+// dump_fd joins the thread itself; freeing only releases the buffers
+mrb_data_type const fd_writer_type = { "Marshal::FdWriter", &fd_writer_free };
+
+struct fd_out {
+  fd_out(mrb_state* M, int fd)
+      : M(M), writer(new fd_writer(fd))
+      , holder(mrb_obj_value(mrb_data_object_alloc(M, NULL, writer, &fd_writer_type))) {}
+
+  mrb_state * const M;
+  fd_writer* writer;
+  mrb_value holder; // keeps `writer` owned by the GC
+
+  void byte(uint8_t const v) {
+    writer->front.push_back(static_cast<char>(v));
+    if(writer->front.size() >= fd_writer::BUFFER_SIZE) { check(writer->submit()); }
+  }
+
+  void byte_array(char const *buf, size_t len) {
+    writer->front.insert(writer->front.end(), buf, buf + len);
+    if(writer->front.size() >= fd_writer::BUFFER_SIZE) { check(writer->submit()); }
+  }
+
+  void finish() { check(writer->finish()); }
+  void abort() { writer->abort(); }
+
+ private:
+  void check(int const err) {
+    if(err == 0) { return; }
+    errno = err;
+    mrb_sys_fail(M, "write");
+  }
+};
+#endif
+
 template<class In>
 struct read_context : public utility {
   typedef In in_type;
-  read_context(mrb_state* M, in_type in) : utility(M), in_(in) {}
+  read_context(mrb_state* M, in_type in)
+      : utility(M), in_(in), encoding_sym(mrb_intern_lit(M, "E"))
+      , regexp_cache(mrb_hash_new(M)), in_uclass(false) {}
 
   in_type in_;
+  mrb_sym const encoding_sym;
+  mrb_value const regexp_cache; // (source, options) -> Regexp of this load
+  bool in_uclass; // next object gets its class replaced by 'C'
 
   read_context& version() {
     uint8_t const major_version = in_.byte();
@@ -422,33 +883,57 @@ struct read_context : public utility {
   }
 
   void number_too_big() {
-    mrb_assert(false);
+    mrb_raise(M, mrb_class_get(M, "RangeError"), "number too big for mrb_int");
   }
 
   mrb_int fixnum() {
-    mrb_int const c = static_cast<signed char>(in_.byte());
-
-    if(c == 0) return 0;
-    else if(c > 0) {
-      if(4 < c and c < 128) { return c - 5; }
-      if(c > int(sizeof(mrb_int))) { number_too_big(); }
-      mrb_int ret = 0;
-      for(mrb_int i = 0; i < c; ++i) {
-        ret |= static_cast<mrb_int>(in_.byte()) << (8*i);
+    int const c = static_cast<signed char>(in_.byte());
+
+    if(c == 0) { return 0; }
+    else if(c > 4) { return c - 5; }
+    else if(c < -4) { return c + 5; }
+
+    int const len = c > 0? c : -c;
+    char const* p = in_.peek(len);
+    if(p) { in_.skip(len); }
+    else { p = RSTRING_PTR(in_.byte_array(len)); }
+
+    // negative values are sign extended from the highest byte read
+    uint64_t const x = load_little_endian(p, len) | (c > 0? 0 : ~uint64_t(0) << (8 * len));
+
+    int64_t const ret = static_cast<int64_t>(x);
+    if(ret < MRB_INT_MIN or MRB_INT_MAX < ret) { number_too_big(); }
+    return static_cast<mrb_int>(ret);
+  }
+
+  mrb_value bignum(char const sign, char const* p, size_t len) {
+    while(len > 0 and p[len - 1] == 0) { --len; } // drop padding
+
+    if(len <= sizeof(uint64_t)) {
+      uint64_t const mag = load_little_endian(p, len);
+      if(sign == '-' and mag <= uint64_t(MRB_INT_MAX) + 1) {
+        return mrb_fixnum_value(static_cast<mrb_int>(0 - mag));
       }
-      return ret;
-    }
-    else {
-      if(-129 < c and c < -4) { return c + 5; }
-      mrb_int const len = -c;
-      if(len > int(sizeof(mrb_int))) { number_too_big(); }
-      mrb_int ret = ~0;
-      for(mrb_int i = 0; i < len; ++i) {
-        ret &= ~(0xff << (8*i));
-        ret |= static_cast<mrb_int>(in_.byte()) << (8*i);
+      if(sign != '-' and mag <= uint64_t(MRB_INT_MAX)) {
+        return mrb_fixnum_value(static_cast<mrb_int>(mag));
       }
-      return ret;
     }
+
+#ifdef MRB_USE_BIGINT
+    static char const digits[] = "0123456789abcdef";
+    mrb_value const hex = mrb_str_new(M, NULL, len * 2);
+    char* const dst = RSTRING_PTR(hex);
+    for(size_t i = 0; i < len; ++i) { // most significant byte first
+      uint8_t const b = p[len - 1 - i];
+      dst[2 * i] = digits[b >> 4];
+      dst[2 * i + 1] = digits[b & 0xf];
+    }
+    mrb_value const ret = mrb_funcall(M, hex, "to_i", 1, mrb_fixnum_value(16));
+    return sign == '-'? mrb_funcall(M, ret, "-@", 0) : ret;
+#else
+    number_too_big();
+    return mrb_nil_value();
+#endif
   }
 
   mrb_value string() { return in_.byte_array(fixnum()); }
@@ -475,6 +960,56 @@ struct read_context : public utility {
     mrb_ary_set(M, objects, id, v);
   }
 
+  // skips CRuby's `\x06:\x06ET` / `\x06;<id>T` encoding only ivar of String with byte compares
+  bool skip_encoding_ivar() {
+    char const* p = in_.peek(5);
+    if(p and p[0] == 6 and p[1] == ':' and p[2] == 6 and p[3] == 'E' and (p[4] == 'T' or p[4] == 'F')) {
+      mrb_ary_push(M, symbols, mrb_symbol_value(encoding_sym));
+      in_.skip(5);
+      return true;
+    }
+
+    p = in_.peek(4);
+    if(p and p[0] == 6 and p[1] == ';' and (p[3] == 'T' or p[3] == 'F')) {
+      uint8_t const c = p[2];
+      mrb_int const sym_id = c == 0? 0 : c - 5;
+      if((c == 0 or (5 < c and c < 128)) and sym_id < RARRAY_LEN(symbols) and
+         RARRAY_PTR(symbols)[sym_id] == encoding_sym) {
+        in_.skip(4);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  mrb_value compile_regexp(mrb_value const& source, mrb_value const& options) {
+    mrb_value args[] = { source, options };
+    return mrb_funcall_argv(M, mrb_obj_value(regexp_class), mrb_intern_lit(M, "new"), 2, args);
+  }
+
+  // identical Regexp records of one load share one compiled object
+  mrb_value regexp(mrb_value const& source, uint8_t const options, bool const cacheable) {
+    if(not cacheable) { return compile_regexp(source, mrb_fixnum_value(options)); }
+
+    mrb_value const key = mrb_str_dup(M, source);
+    char const opt = options;
+    mrb_str_cat(M, key, &opt, 1);
+
+    mrb_value ret = mrb_hash_get(M, regexp_cache, key);
+    if(mrb_nil_p(ret)) {
+      ret = compile_regexp(source, mrb_fixnum_value(options));
+      mrb_hash_set(M, regexp_cache, key, ret);
+    }
+    return ret;
+  }
+
+  // gives the Regexp of link `id` its own object before setting its ivars
+  mrb_value unshare_regexp(mrb_value const& v, mrb_int const id) {
+    mrb_value const ret = compile_regexp(mrb_funcall(M, v, "source", 0), mrb_funcall(M, v, "options", 0));
+    if(id < RARRAY_LEN(objects) and RARRAY_PTR(objects)[id] == v) { register_link(id, ret); }
+    return ret;
+  }
+
   mrb_value marshal();
 };
 
@@ -482,6 +1017,8 @@ template<class In>
 mrb_value read_context<In>::marshal() {
   char const tag = in_.byte();
   mrb_int const id = RARRAY_LEN(objects);
+  bool const uclass = in_uclass;
+  in_uclass = false;
 
   mrb_value ret = mrb_nil_value();
 
@@ -502,8 +1039,13 @@ mrb_value read_context<In>::marshal() {
       return mrb_symbol_value(symbol());
 
     case 'I': { // instance variable
+      mrb_int const inner_id = RARRAY_LEN(objects);
       ret = marshal();
+      if((mrb_string_p(ret) or mrb_obj_class(M, ret) == regexp_class) and
+         skip_encoding_ivar()) { return ret; }
+
       size_t const len = fixnum();
+      bool unshared = false;
       int const ai = mrb_gc_arena_save(M);
       for(size_t i = 0; i < len; ++i) {
         mrb_sym const key = symbol();
@@ -513,6 +1055,10 @@ mrb_value read_context<In>::marshal() {
         if (key_len == 1 and sym[0] == 'E') {
           marshal(); // TODO: store ignored encoding
         } else {
+          if(mrb_obj_class(M, ret) == regexp_class and not unshared) {
+            ret = unshare_regexp(ret, inner_id);
+            unshared = true;
+          }
           mrb_iv_set(M, ret, key, marshal());
         }
         mrb_gc_arena_restore(M, ai);
@@ -531,6 +1077,7 @@ mrb_value read_context<In>::marshal() {
 
     case 'C': { // sub class instance variable of string, regexp, array, hash
       RClass* const klass = path2class(symbol());
+      in_uclass = true;
       ret = marshal();
       mrb_basic_ptr(ret)->c = klass; // set class
       return ret;
@@ -575,9 +1122,10 @@ mrb_value read_context<In>::marshal() {
 
     case '/': { // regexp
       // TODO: check Regexp class is defined
-      mrb_value args[] = { string(), mrb_fixnum_value(in_.byte()) };
-      register_link(id, ret = mrb_funcall_argv(M, mrb_obj_value(mrb_class_get(M, "Regexp")),
-                                               mrb_intern_lit(M, "new"), 2, args));
+      mrb_value const source = string();
+      uint8_t const options = in_.byte();
+      // a Regexp whose class gets replaced can't be shared
+      register_link(id, ret = regexp(source, options, not uclass));
       break;
     }
 
@@ -654,7 +1202,13 @@ mrb_value read_context<In>::marshal() {
       break;
     }
 
-    case 'l': // bignum (unsupported)
+    case 'l': { // bignum
+      char const sign = in_.byte();
+      mrb_int const len = fixnum() * 2;
+      mrb_value const mag = in_.byte_array(len);
+      register_link(id, ret = bignum(sign, RSTRING_PTR(mag), len));
+      break;
+    }
 
     default:
       mrb_raise(M, mrb_class_get(M, "TypeError"), "Unsupported type");
@@ -682,6 +1236,9 @@ struct string_in {
 
   void restore_byte(char) { --current; }
 
+  char const* peek(size_t len) const { return (current + len) <= end? current : NULL; }
+  void skip(size_t len) { current += len; }
+
   mrb_value byte_array(size_t len) {
     if((current + len) > end) {
       mrb_raise(M, mrb_class_get(M, "RangeError"), "string out of range");
@@ -709,6 +1266,10 @@ struct io_in {
     mrb_funcall(M, io, "ungetc", 1, mrb_str_new(M, &c, 1));
   }
 
+  // peeking is not supported so fast paths fall back to normal decoding
+  char const* peek(size_t) const { return NULL; }
+  void skip(size_t len) { byte_array(len); }
+
   mrb_value byte_array(size_t len) {
     mrb_value const ret = mrb_funcall(M, io, "read", 1, mrb_fixnum_value(len));
     if(static_cast<size_t>(RSTRING_LEN(ret)) < len) {
@@ -718,6 +1279,155 @@ struct io_in {
   }
 };
 
+// clones an object graph following the same rules as write_context/read_context
+struct copy_context : public utility {
+  copy_context(mrb_state* M) : utility(M), links(mrb_hash_new(M)) {}
+
+  mrb_value const links; // object id of source -> index in `objects`
+
+  mrb_int register_link(mrb_value const& src, mrb_value const& dst) {
+    mrb_int const id = RARRAY_LEN(objects);
+    mrb_hash_set(M, links, mrb_fixnum_value(mrb_obj_id(src)), mrb_fixnum_value(id));
+    mrb_ary_push(M, objects, dst); // keep copies alive
+    return id;
+  }
+
+  bool is_struct(mrb_value const& v) const {
+    return mrb_class_defined(M, "Struct") and mrb_obj_is_kind_of(M, v, mrb_class_get(M, "Struct"));
+  }
+
+  mrb_value marshal(mrb_value const& v);
+};
+
+mrb_value copy_context::marshal(mrb_value const& v) {
+  // immediates and immutable values are shared
+  switch(mrb_vtype(mrb_type(v))) {
+    case MRB_TT_FALSE:
+    case MRB_TT_TRUE:
+    case MRB_TT_FIXNUM:
+#ifdef MRB_USE_BIGINT
+    case MRB_TT_BIGINT:
+#endif
+    case MRB_TT_SYMBOL:
+    case MRB_TT_FLOAT:
+    case MRB_TT_CLASS:
+    case MRB_TT_MODULE:
+      return v;
+
+    default: break;
+  }
+
+  // check for link
+  {
+    mrb_value const l = mrb_hash_get(M, links, mrb_fixnum_value(mrb_obj_id(v)));
+    if(not mrb_nil_p(l)) {
+      mrb_value const ret = RARRAY_PTR(objects)[mrb_fixnum(l)];
+      // copy of marshal_dump/_dump object isn't created until its data is copied
+      if(mrb_nil_p(ret)) {
+        mrb_raise(M, mrb_class_get(M, "ArgumentError"), "cyclic reference to marshal_dump/_dump object");
+      }
+      return ret;
+    }
+  }
+
+  RClass* const cls = mrb_obj_class(M, v);
+  RClass* const real_class = mrb_class_real(mrb_class(M, v));
+  mrb_value ret = mrb_nil_value();
+
+  // check marshal_dump
+  if(mrb_obj_respond_to(M, cls, mrb_intern_lit(M, "marshal_dump"))) {
+    mrb_int const id = register_link(v, mrb_nil_value());
+    mrb_value const data = marshal(mrb_funcall(M, v, "marshal_dump", 1, mrb_nil_value()));
+    ret = mrb_funcall(M, mrb_obj_value(real_class), "marshal_load", 1, data);
+    mrb_ary_set(M, objects, id, ret);
+    return ret;
+  }
+  // check _dump
+  if(mrb_obj_respond_to(M, cls, mrb_intern_lit(M, "_dump"))) {
+    mrb_int const id = register_link(v, mrb_nil_value());
+    ret = mrb_funcall(M, mrb_obj_value(real_class), "_load", 1,
+                      mrb_funcall(M, v, "_dump", 1, mrb_nil_value()));
+    mrb_ary_set(M, objects, id, ret);
+    return ret;
+  }
+
+  mrb_value const iv_keys = mrb_funcall(M, v, "instance_variables", 0);
+  int const ai = mrb_gc_arena_save(M);
+
+  if(cls == regexp_class) {
+    mrb_value args[] = { mrb_funcall(M, v, "source", 0), mrb_fixnum_value(0) };
+    if(mrb_obj_respond_to(M, cls, mrb_intern_lit(M, "options"))) {
+      args[1] = mrb_funcall(M, v, "options", 0);
+    }
+    ret = mrb_funcall_argv(M, mrb_obj_value(regexp_class), mrb_intern_lit(M, "new"), 2, args);
+    register_link(v, ret);
+    return ret;
+  } else if(is_struct(v)) {
+    mrb_value const members = mrb_iv_get(M, mrb_obj_value(mrb_class(M, v)), mrb_intern_lit(M, "__members__"));
+    mrb_check_type(M, members, MRB_TT_ARRAY);
+    // allocate without initialize like load and register before copying
+    // members so cyclic members link to the copy
+    ret = mrb_obj_value(mrb_obj_alloc(M, MRB_INSTANCE_TT(real_class), real_class));
+    register_link(v, ret);
+    for (mrb_int i = 0; i < RARRAY_LEN(members); ++i) {
+      mrb_ary_push(M, ret, marshal(RARRAY_PTR(v)[i])); // struct shares array layout
+      mrb_gc_arena_restore(M, ai);
+    }
+    return ret;
+  } else if(mrb_type(v) == MRB_TT_OBJECT) {
+    ret = mrb_obj_value(mrb_obj_alloc(M, MRB_TT_OBJECT, real_class));
+    register_link(v, ret);
+  } else switch(mrb_vtype(mrb_type(v))) {
+      case MRB_TT_STRING:
+        ret = mrb_str_new(M, RSTRING_PTR(v), RSTRING_LEN(v));
+        mrb_basic_ptr(ret)->c = real_class;
+        register_link(v, ret);
+        break;
+
+      case MRB_TT_ARRAY: {
+        ret = mrb_ary_new_capa(M, RARRAY_LEN(v));
+        mrb_basic_ptr(ret)->c = real_class;
+        register_link(v, ret);
+        for(mrb_int i = 0; i < RARRAY_LEN(v); ++i) {
+          mrb_ary_push(M, ret, marshal(RARRAY_PTR(v)[i]));
+          mrb_gc_arena_restore(M, ai);
+        }
+      } break;
+
+      case MRB_TT_HASH: {
+        mrb_value const keys = mrb_hash_keys(M, v);
+        ret = mrb_hash_new_capa(M, RARRAY_LEN(keys));
+        mrb_basic_ptr(ret)->c = real_class;
+        register_link(v, ret);
+        int const keys_ai = mrb_gc_arena_save(M);
+        for(mrb_int i = 0; i < RARRAY_LEN(keys); ++i) {
+          mrb_value const k = RARRAY_PTR(keys)[i];
+          mrb_value const key = marshal(k);
+          mrb_hash_set(M, ret, key, marshal(mrb_hash_get(M, v, k)));
+          mrb_gc_arena_restore(M, keys_ai);
+        }
+
+        // TODO: check proc default
+        mrb_value const default_val = mrb_iv_get(M, v, mrb_intern_lit(M, "ifnone"));
+        if(not mrb_nil_p(default_val)) {
+          mrb_iv_set(M, ret, mrb_intern_lit(M, "ifnone"), marshal(default_val));
+        }
+      } break;
+
+      default:
+        mrb_raise(M, mrb_class_get(M, "TypeError"), "unsupported type");
+        return mrb_nil_value();
+    }
+
+  // copy instance variables
+  for(mrb_int i = 0; i < RARRAY_LEN(iv_keys); ++i) {
+    mrb_sym const key = mrb_symbol(RARRAY_PTR(iv_keys)[i]);
+    mrb_iv_set(M, ret, key, marshal(mrb_iv_get(M, v, key)));
+    mrb_gc_arena_restore(M, ai);
+  }
+  return ret;
+}
+
 mrb_value marshal_dump(mrb_state* M, mrb_value) {
   mrb_value obj, io = mrb_nil_value();
   mrb_int limit = -1;
@@ -729,15 +1439,72 @@ mrb_value marshal_dump(mrb_state* M, mrb_value) {
   }
 
   if (mrb_nil_p(io)) {
-    mrb_value const str = mrb_str_new(M, NULL, 0);
-    write_context<string_out>(M, string_out(M, str)).version().marshal(obj, limit);
-    return str;
+    return dump_to_string(M, obj, mrb_str_new(M, NULL, 0), limit);
   } else {
     write_context<io_out>(M, io_out(M, io)).version().marshal(obj, limit);
     return io;
   }
 }
 
+mrb_value marshal_dump_into(mrb_state* M, mrb_value) {
+  mrb_value obj, buf;
+  mrb_int limit = -1, capa_hint = 0;
+  mrb_get_args(M, "oS|ii", &obj, &buf, &limit, &capa_hint);
+  if(capa_hint < 0) { mrb_raise(M, mrb_class_get(M, "ArgumentError"), "negative capacity"); }
+
+  return dump_into_string(M, obj, buf, limit, capa_hint);
+}
+
+mrb_value marshal_profile(mrb_state* M, mrb_value) {
+  mrb_value obj;
+  mrb_bool ivars = FALSE;
+  mrb_get_args(M, "o|b", &obj, &ivars);
+
+  write_context<string_out, class_profile_ref> ctx(M, string_out(M, mrb_str_new(M, NULL, 0)),
+                                                  class_profile_ref(M, ivars));
+  ctx.version().marshal(obj);
+  return ctx.profile_.data->report(M);
+}
+
+#ifdef MRUBY_MARSHAL_FD_OUT
+struct dump_fd_args {
+  write_context<fd_out>* ctx;
+  mrb_value obj;
+  mrb_int limit;
+};
+
+mrb_value dump_fd_body(mrb_state*, mrb_value data) {
+  dump_fd_args* const args = static_cast<dump_fd_args*>(mrb_cptr(data));
+  args->ctx->version().marshal(args->obj, args->limit);
+  args->ctx->out_.finish();
+  return mrb_nil_value();
+}
+
+mrb_value dump_fd_ensure(mrb_state*, mrb_value data) {
+  static_cast<dump_fd_args*>(mrb_cptr(data))->ctx->out_.abort();
+  return mrb_nil_value();
+}
+
+mrb_value marshal_dump_fd(mrb_state* M, mrb_value) {
+  mrb_value obj;
+  mrb_int fd, limit = -1;
+  mrb_get_args(M, "oi|i", &obj, &fd, &limit);
+
+  write_context<fd_out> ctx(M, fd_out(M, fd));
+  dump_fd_args args = { &ctx, obj, limit };
+  // writer thread must be stopped before an exception leaves dump_fd
+  mrb_ensure(M, &dump_fd_body, mrb_cptr_value(M, &args), &dump_fd_ensure, mrb_cptr_value(M, &args));
+  return mrb_fixnum_value(fd);
+}
+#endif
+
+mrb_value marshal_deep_copy(mrb_state* M, mrb_value) {
+  mrb_value obj;
+  mrb_get_args(M, "o", &obj);
+
+  return copy_context(M).marshal(obj);
+}
+
 mrb_value marshal_load(mrb_state* M, mrb_value) {
   mrb_value obj;
   mrb_get_args(M, "o", &obj);
@@ -753,15 +1520,22 @@ extern "C" {
 
 mrb_value mrb_marshal_dump(mrb_state* M, mrb_value obj, mrb_value io) {
   if (mrb_nil_p(io)) {
-    mrb_value const str = mrb_str_new(M, NULL, 0);
-    write_context<string_out>(M, string_out(M, str)).version().marshal(obj);
-    return str;
+    return dump_to_string(M, obj, mrb_str_new(M, NULL, 0), -1);
   } else {
     write_context<io_out>(M, io_out(M, io)).version().marshal(obj);
     return io;
   }
 }
 
+mrb_value mrb_marshal_dump_into(mrb_state* M, mrb_value obj, mrb_value buf) {
+  mrb_check_type(M, buf, MRB_TT_STRING);
+  return dump_into_string(M, obj, buf, -1);
+}
+
+mrb_value mrb_marshal_deep_copy(mrb_state* M, mrb_value obj) {
+  return copy_context(M).marshal(obj);
+}
+
 mrb_value mrb_marshal_load(mrb_state* M, mrb_value obj) {
   return mrb_string_p(obj)?
       read_context<string_in>(M, string_in(M, RSTRING_PTR(obj), RSTRING_LEN(obj))).version().marshal():
@@ -774,6 +1548,12 @@ void mrb_mruby_marshal_gem_init(mrb_state* M) {
   mrb_define_module_function(M, mod, "load", &marshal_load, MRB_ARGS_REQ(1));
   mrb_define_module_function(M, mod, "restore", &marshal_load, MRB_ARGS_REQ(1));
   mrb_define_module_function(M, mod, "dump", &marshal_dump, MRB_ARGS_REQ(1));
+  mrb_define_module_function(M, mod, "dump_into", &marshal_dump_into, MRB_ARGS_ARG(2, 2));
+  mrb_define_module_function(M, mod, "profile", &marshal_profile, MRB_ARGS_ARG(1, 1));
+  mrb_define_module_function(M, mod, "deep_copy", &marshal_deep_copy, MRB_ARGS_REQ(1));
+#ifdef MRUBY_MARSHAL_FD_OUT
+  mrb_define_module_function(M, mod, "dump_fd", &marshal_dump_fd, MRB_ARGS_ARG(2, 1));
+#endif
 
   mrb_define_const(M, mod, "MAJOR_VERSION", mrb_fixnum_value(MAJOR_VERSION));
   mrb_define_const(M, mod, "MINOR_VERSION", mrb_fixnum_value(MINOR_VERSION));
@@ -1,5 +1,12 @@
 #include <mruby.h>
 #include <mruby/marshal.h>
+#include <mruby/string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <stdlib.h>
+#include <unistd.h>
+#define MARSHAL_TEST_FD
+#endif
 
 static mrb_value marshal_load(mrb_state *M, mrb_value self) {
   mrb_value o;
@@ -13,8 +20,47 @@ static mrb_value marshal_dump(mrb_state *M, mrb_value self) {
   return mrb_marshal_dump(M, o, mrb_nil_value());
 }
 
+static mrb_value marshal_deep_copy(mrb_state *M, mrb_value self) {
+  mrb_value o;
+  mrb_get_args(M, "o", &o);
+  return mrb_marshal_deep_copy(M, o);
+}
+
+#ifdef MARSHAL_TEST_FD
+/* unlinked temporary file so the writer never blocks like on a full pipe */
+static mrb_value marshal_test_tmpfd(mrb_state *M, mrb_value self) {
+  char path[] = "/tmp/mruby-marshal-XXXXXX";
+  int const fd = mkstemp(path);
+  if (fd < 0) { mrb_sys_fail(M, "mkstemp"); }
+  unlink(path);
+  return mrb_fixnum_value(fd);
+}
+
+/* reads whole content of fd from the beginning and closes it */
+static mrb_value marshal_test_read_fd(mrb_state *M, mrb_value self) {
+  mrb_int fd;
+  mrb_value ret = mrb_str_new(M, NULL, 0);
+  char buf[4096];
+  ssize_t len;
+
+  mrb_get_args(M, "i", &fd);
+  lseek(fd, 0, SEEK_SET);
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    mrb_str_cat(M, ret, buf, len);
+  }
+  close(fd);
+  if (len < 0) { mrb_sys_fail(M, "read"); }
+  return ret;
+}
+#endif
+
 void mrb_mruby_marshal_gem_test(mrb_state *M) {
   struct RClass *cls = mrb_module_get(M, "Marshal");
   mrb_define_module_function(M, cls, "mrb_marshal_load", marshal_load, MRB_ARGS_REQ(1));
   mrb_define_module_function(M, cls, "mrb_marshal_dump", marshal_dump, MRB_ARGS_REQ(1));
+  mrb_define_module_function(M, cls, "mrb_marshal_deep_copy", marshal_deep_copy, MRB_ARGS_REQ(1));
+#ifdef MARSHAL_TEST_FD
+  mrb_define_module_function(M, cls, "test_tmpfd", marshal_test_tmpfd, MRB_ARGS_NONE());
+  mrb_define_module_function(M, cls, "test_read_fd", marshal_test_read_fd, MRB_ARGS_REQ(1));
+#endif
 }
@@ -21,6 +21,83 @@ assert 'marshal io' do
   assert_equal "\x04\x08{\x06\"\x0dhogehoge:\x0dhogehoge", io.string
 end
 
+assert 'marshal fd' do
+  # write error of background writer is raised in caller
+  assert_raise(StandardError) { Marshal.dump_fd({"hogehoge" => :hogehoge}, -1) }
+  assert_raise(StandardError) { Marshal.dump_fd("a" * 0x20000, -1) }
+
+  # smaller and larger than the writer buffer
+  [{"hogehoge" => :hogehoge}, ["a" * 0x10000, "b" * 0x20001, (1..0x1000).to_a]].each do |obj|
+    fd = Marshal.test_tmpfd
+    assert_equal fd, Marshal.dump_fd(obj, fd)
+    assert_equal Marshal.dump(obj), Marshal.test_read_fd(fd)
+  end
+
+  # writer is stopped before the exception leaves dump_fd
+  fd = Marshal.test_tmpfd
+  assert_raise(TypeError) { Marshal.dump_fd(["a" * 0x20000, Proc.new {}], fd) }
+  written = Marshal.test_read_fd(fd)
+  assert_true written.bytesize < Marshal.dump(["a" * 0x20000, nil]).bytesize
+  assert_equal Marshal.dump(["a" * 0x20000, nil])[0, written.bytesize], written
+end if Marshal.respond_to? :dump_fd
+
+assert 'Marshal.dump_into' do
+  buf = "previous content" * 0x100
+  ret = Marshal.dump_into({"hogehoge" => :hogehoge}, buf)
+  assert_true ret.equal?(buf)
+  assert_equal "\x04\x08{\x06\"\x0dhogehoge:\x0dhogehoge", buf
+
+  long = "a" * 0x1000
+  assert_equal Marshal.dump([long, long, 1]), Marshal.dump_into([long, long, 1], buf)
+  assert_equal Marshal.dump(nil), Marshal.dump_into(nil, buf)
+  assert_equal Marshal.dump(nil), Marshal.dump_into(nil, "")
+
+  assert_raise(TypeError) { Marshal.dump_into(nil, nil) }
+
+  # initial capacity hint
+  buf = ""
+  assert_equal Marshal.dump([long, 1]), Marshal.dump_into([long, 1], buf, -1, 0x2000)
+  assert_raise(ArgumentError) { Marshal.dump_into(nil, buf, -1, -1) }
+
+  # buffer is empty while dumping
+  buf = "previous content" * 0x100
+  assert_equal Marshal.dump([""]), Marshal.dump_into([buf], buf)
+
+  # left empty when dumping raises partway
+  buf = "previous content" * 0x100
+  assert_raise(ArgumentError) { Marshal.dump_into({"hogehoge" => { :hogehoge => 0 }}, buf, 2) }
+  assert_equal "", buf
+  buf = "previous content" * 0x100
+  assert_raise(TypeError) { Marshal.dump_into(["a" * 0x1000, Proc.new {}], buf) }
+  assert_equal "", buf
+end
+
+assert 'Marshal.dump_into with buffer modified by callback' do
+  class BufferModifier
+    def initialize(buf) @buf = buf end
+    def marshal_dump a = 0
+      @buf << "x" * 0x1000
+      @buf.replace "short"
+      "test"
+    end
+  end
+  buf = "previous content"
+  obj = ["a" * 0x100, BufferModifier.new(buf), "b" * 0x100]
+  expected = Marshal.dump(["a" * 0x100, BufferModifier.new(""), "b" * 0x100])
+  assert_equal expected, Marshal.dump_into(obj, buf)
+  assert_equal expected, buf
+end
+
+assert 'Marshal.dump_into with buffer frozen by callback' do
+  class BufferFreezer
+    def initialize(buf) @buf = buf end
+    def marshal_dump a = 0; @buf.freeze; "test" end
+  end
+  buf = "previous content"
+  assert_raise(FrozenError) { Marshal.dump_into([BufferFreezer.new(buf)], buf) }
+  assert_equal "", buf
+end
+
 assert 'check marshal dump version' do
   assert_raise(TypeError) { Marshal.load("\x03\x08") }
   Marshal.dump(nil) == "\x04\x080"
@@ -59,6 +136,28 @@ assert('marshal fixnum') {
   }.each { |k,v| result = result and check_load_dump(k, v) }
 }
 
+assert('marshal bignum') {
+  check_load_dump 2**31 - 1, "i\x04\xff\xff\xff\x7f"
+  check_load_dump(-(2**31), "i\xfc\x00\x00\x00\x80")
+  check_load_dump 2**31, "l+\a\x00\x00\x00\x80"
+  check_load_dump(-(2**31) - 1, "l-\a\x01\x00\x00\x80")
+  check_load_dump 2**40, "l+\b\x00\x00\x00\x00\x00\x01"
+  check_load_dump [2**40, 2**40], "[\al+\b\x00\x00\x00\x00\x00\x01@\x06"
+  assert_equal 2**32 - 1, load("i\x04\xff\xff\xff\xff")
+  assert_equal(-(2**32), load("i\xfc\x00\x00\x00\x00"))
+  assert_equal 2**32 - 1, Marshal.load(StringIO.new("\x04\bi\x04\xff\xff\xff\xff"))
+} if (2**40).kind_of? Integer
+
+assert('load bignum out of mrb_int') {
+  data = "l+\n\x00\x00\x00\x00\x00\x00\x00\x00\x01\x00"
+  if (2**64).kind_of? Integer
+    check_load_dump 2**64, data
+    check_load_dump(-(2**64), "l-" + data[2, data.length - 2])
+  else
+    assert_raise(RangeError) { load data }
+  end
+}
+
 assert("marshal string") {
   check_load_dump "hogehoge", "\"\x0dhogehoge"
 }
@@ -86,6 +185,29 @@ assert("marshal regexp") {
   check_load_dump(/hogehoge/, "/\x0dhogehoge\x00")
 } if Object.const_defined? :Regexp
 
+assert("marshal regexp cache") {
+  # identical Regexp records of one load share one compiled object
+  loaded = Marshal.load Marshal.dump([/hogehoge/, /hogehoge/, /hogehoge/i, /foo/])
+  assert_equal [/hogehoge/, /hogehoge/, /hogehoge/i, /foo/], loaded
+  assert_true loaded[0].equal?(loaded[1])
+  assert_false loaded[0].equal?(loaded[2])
+
+  # but not across loads
+  data = Marshal.dump(/hogehoge/)
+  assert_false Marshal.load(data).equal?(Marshal.load(data))
+
+  # CRuby dumps regexp with encoding instance variable
+  assert_equal [/ab/, /ab/], Marshal.load("\x04\b[\aI/\aab\x00\x06:\x06EFI/\aab\x00\x06;\x00F")
+
+  # instance variables of a record don't leak to other records
+  loaded = Marshal.load("\x04\b[\b/\aab\x00I/\aab\x00\x06:\a@ai\x06@\a")
+  assert_equal [/ab/, /ab/, /ab/], loaded
+  assert_false loaded[0].equal?(loaded[1])
+  assert_nil loaded[0].instance_variable_get(:@a)
+  assert_equal 1, loaded[1].instance_variable_get(:@a)
+  assert_true loaded[1].equal?(loaded[2])
+} if Object.const_defined? :Regexp
+
 assert('marshal array') {
   check_load_dump ["hogehoge", :hogehoge], "[\x07\"\x0dhogehoge:\x0dhogehoge"
 }
@@ -113,6 +235,11 @@ end
 assert 'ignore encoding instance variable of string' do
   # load `Marshal.dump 'test'` generated by CRuby with encoding
   assert_equal ['test'], Marshal.load("\x04\b[\x06I\"\ttest\x06:\x06ET")
+  # symbol link to `E`
+  assert_equal ['test', 'ab'], Marshal.load("\x04\b[\aI\"\ttest\x06:\x06ETI\"\aab\x06;\x00F")
+  # more than one instance variable takes the generic path
+  assert_equal ['test', 'ab'], Marshal.load("\x04\b[\aI\"\ttest\x06:\x06ETI\"\aab\a;\x00T;\x00F")
+  assert_equal ['test'], Marshal.load(StringIO.new("\x04\b[\x06I\"\ttest\x06:\x06ET"))
 end
 
 assert 'marshal Struct' do
@@ -196,6 +323,89 @@ assert 'user defined marshal method' do
   check_load_dump ObjectDumper.new, "U:\x11ObjectDumper\"\ttest"
 end
 
+assert 'Marshal.deep_copy' do
+  shared = "shared"
+  src = { :a => [shared, shared, 1.0], "b" => StringSub.new('foo'), :c => HashSubIV.new('bar') }
+  dst = Marshal.deep_copy src
+  assert_equal src, dst
+  assert_false src.equal?(dst)
+  assert_false shared.equal?(dst[:a][0])
+  assert_true dst[:a][0].equal?(dst[:a][1])
+  assert_equal StringSub, dst["b"].class
+  assert_equal HashSubIV, dst[:c].class
+  assert_equal "foo", dst[:c].instance_variable_get(:@val)
+
+  cyclic = []
+  cyclic << cyclic
+  copied = Marshal.deep_copy cyclic
+  assert_true copied[0].equal?(copied)
+
+  assert_equal B.new, Marshal.deep_copy(B.new)
+  assert_equal BinaryDumper.new, Marshal.deep_copy(BinaryDumper.new)
+  assert_equal ObjectDumper.new, Marshal.deep_copy(ObjectDumper.new)
+  assert_equal ModTest::A::B, Marshal.deep_copy(ModTest::A::B)
+
+  assert_equal Marshal.load(Marshal.dump(src)), Marshal.mrb_marshal_deep_copy(src)
+end
+
+assert 'Marshal.deep_copy cyclic Struct' do
+  cls = Struct.new(:a, :b)
+  s = cls.new
+  s.a = s
+  s.b = [s]
+  copied = Marshal.deep_copy s
+  assert_false copied.equal?(s)
+  assert_true copied.a.equal?(copied)
+  assert_true copied.b[0].equal?(copied)
+end
+
+assert 'Marshal.deep_copy Struct with validating initialize' do
+  StrictStruct = Struct.new(:a, :b) do
+    def initialize(a, b)
+      raise ArgumentError, 'a is required' unless a
+      super
+    end
+  end
+  src = StrictStruct.new "foo", [1]
+  copied = Marshal.deep_copy src
+  assert_equal StrictStruct, copied.class
+  assert_equal src, copied
+  assert_false src.a.equal?(copied.a)
+  assert_equal Marshal.load(Marshal.dump(src)), copied
+end
+
+assert 'Marshal.deep_copy cyclic marshal_dump' do
+  class CyclicDumper
+    def marshal_dump a = 0; [self] end
+    def self.marshal_load data, a = 0; CyclicDumper.new end
+  end
+  assert_raise(ArgumentError) { Marshal.deep_copy CyclicDumper.new }
+end
+
+assert 'Marshal.deep_copy raising partway' do
+  # identity map lives in mruby heap so nothing leaks on raise
+  100.times do
+    assert_raise(TypeError) { Marshal.deep_copy [[1, "a"], { :b => "c" }, Proc.new {}] }
+  end
+end
+
+assert 'Marshal.profile' do
+  obj = [B.new, B.new, "hogehoge", { :a => "foo" }]
+  report = Marshal.profile obj
+  assert_equal [B, String, Hash, Array], report.keys
+  assert_equal 2, report[B][:count]
+  assert_equal 2, report[String][:count]
+  assert_equal Marshal.dump(obj).bytesize - 2, report.values.map { |v| v[:bytes] }.inject(:+)
+  assert_false report[B].key?(:ivars)
+
+  report = Marshal.profile obj, true
+  assert_equal({ :@a => 10 }, report[B][:ivars])
+
+  100.times do
+    assert_raise(TypeError) { Marshal.profile [B.new, { :b => "c" }, Proc.new {}], true }
+  end
+end
+
 assert '#21' do
   check_load_dump [:one, :two, :three], "[\b:\bone:\btwo:\nthree"
 end